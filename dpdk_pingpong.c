@@ -1,4 +1,6 @@
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 
 #include <rte_byteorder.h>
@@ -11,6 +13,9 @@
 #include <rte_mbuf.h>
 #include <rte_malloc.h>
 #include <rte_ether.h>
+#include <rte_cycles.h>
+#include <rte_memory.h>
+#include <rte_mempool.h>
 
 #define APP "pingpong"
 
@@ -35,7 +40,48 @@ static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
 
 int RTE_LOGTYPE_PINGPONG;
 
-struct rte_mempool *pingpong_pktmbuf_pool = NULL;
+/*
+ * Size-class mempools.
+ * Frames are built from the smallest class that fits them. The RX queue
+ * uses the class of the largest frame; its buffer sizes stay multiples of
+ * 1 KB, which is the RX buffer granularity of many NICs. The small class
+ * only holds TX templates, so small pings do not touch 2 KB buffers.
+ */
+#define JUMBO_MTU 9000
+#define JUMBO_FRAME_LEN (JUMBO_MTU + RTE_ETHER_HDR_LEN + RTE_ETHER_CRC_LEN)
+
+enum size_class {
+    SIZE_CLASS_SMALL,
+    SIZE_CLASS_MTU,
+    SIZE_CLASS_JUMBO,
+    NB_SIZE_CLASSES
+};
+
+static const struct {
+    const char *name;
+    uint16_t buf_size;  /* largest frame, CRC included */
+} size_classes[NB_SIZE_CLASSES] = {
+    [SIZE_CLASS_SMALL] = { "small", 128 },
+    [SIZE_CLASS_MTU] = { "mtu", 2048 },
+    [SIZE_CLASS_JUMBO] = { "jumbo", 9216 },
+};
+
+/* NULL for the classes that are not used by this run */
+static struct rte_mempool *size_class_pools[NB_SIZE_CLASSES];
+/* the class of the RX buffers */
+static enum size_class rx_size_class = SIZE_CLASS_MTU;
+/* indirect mbufs that reference the data of a template */
+static struct rte_mempool *clone_pool = NULL;
+
+/* pre-built frames to one destination, one per size class */
+struct pkt_template {
+    struct rte_mbuf *m[NB_SIZE_CLASSES];
+};
+
+/* payload bytes per packet when a message is packetized */
+static unsigned pkt_payload_max = RTE_ETHER_MTU;
+/* jumbo frames */
+static bool jumbo_mode = false;
 
 /* enabled port */
 static uint16_t portid = 0;
@@ -47,6 +93,50 @@ static uint64_t total_steps = 100;
 /* server mode */
 static bool server_mode = false;
 
+/*
+ * Collective mode.
+ * N peers, listed by MAC address in a file, run collective exchange
+ * patterns. The rank of a peer is the position of its MAC in the list.
+ */
+#define COLL_MAX_PEERS 64
+/* IEEE 802 local experimental ethertype */
+#define COLL_ETHER_TYPE 0x88B5
+#define COLL_HELLO_INTERVAL_MS 100
+/* give up when a peer's data makes no progress for this long */
+#define COLL_RECV_TIMEOUT_MS 5000
+
+enum coll_pkt_type {
+    /* sent periodically until the peer confirms it heard from us */
+    COLL_PKT_HELLO,
+    /* answer to a HELLO, never answered itself */
+    COLL_PKT_HELLO_REPLY,
+    COLL_PKT_DATA,
+};
+
+/* follows the ethernet header of every collective packet */
+struct coll_hdr {
+    uint16_t src_rank;
+    uint16_t type;
+    /* HELLO and HELLO_REPLY: the ranks the sender has heard from */
+    uint64_t heard_mask;
+} __rte_packed;
+
+/* MAC list file, collective mode is disabled when NULL */
+static const char *coll_file = NULL;
+static bool coll_run_ring = true;
+static bool coll_run_alltoall = true;
+static struct rte_ether_addr coll_peers[COLL_MAX_PEERS];
+static unsigned coll_nb_peers = 0;
+static unsigned coll_rank;
+/* ranks we have heard from */
+static uint64_t coll_heard_mask = 0;
+/* ranks that have heard from us */
+static uint64_t coll_known_mask = 0;
+/* data packets received from each rank and not consumed by a step yet */
+static uint64_t coll_credits[COLL_MAX_PEERS];
+/* data packet templates to each rank */
+static struct pkt_template coll_templates[COLL_MAX_PEERS];
+
 static struct rte_eth_conf port_conf = {
     .rxmode = {
         .split_hdr_size = 0,
@@ -63,6 +153,9 @@ static const char short_options[] =
     "i:" /* number of interations */
     "c:" /* client mode, with MAC address */
     "s"  /* server mode */
+    "f:" /* collective mode, with MAC list file */
+    "o:" /* collective operation */
+    "J"  /* jumbo frames */
     ;
 
 /* display usage */
@@ -74,8 +167,11 @@ static void pingpong_usage(const char *prgname)
            "\t-n BYTES: maximum size of the message\n"
            "\t-i ITERS: number of iterations\n"
            "\t-c TARGET_MAC: target MAC address\n"
-           "\t-s: enable server mode\n",
-           prgname);
+           "\t-s: enable server mode\n"
+           "\t-f MAC_FILE: enable collective mode among the peers listed in MAC_FILE\n"
+           "\t-o OP: collective to run: ring, alltoall or all (default all)\n"
+           "\t-J: packetize messages into %u-byte jumbo frames\n",
+           prgname, JUMBO_MTU);
 }
 
 /* Parse the argument given in the command line of the application */
@@ -121,6 +217,24 @@ static int pingpong_parse_args(int argc, char **argv)
             break;
         }
 
+        case 'f':
+            coll_file = optarg;
+            break;
+
+        case 'o':
+            coll_run_ring = !strcmp(optarg, "ring") || !strcmp(optarg, "all");
+            coll_run_alltoall = !strcmp(optarg, "alltoall") || !strcmp(optarg, "all");
+            if (!coll_run_ring && !coll_run_alltoall) {
+                pingpong_usage(prgname);
+                return -1;
+            }
+            break;
+
+        case 'J':
+            jumbo_mode = true;
+            pkt_payload_max = JUMBO_MTU;
+            rx_size_class = SIZE_CLASS_JUMBO;
+            break;
 
         default:
             pingpong_usage(prgname);
@@ -136,46 +250,125 @@ static int pingpong_parse_args(int argc, char **argv)
     return ret;
 }
 
+/* the smallest class in use that fits a frame */
+static enum size_class frame_size_class(unsigned frame_len)
+{
+    for (int cls = 0; cls < NB_SIZE_CLASSES; ++cls)
+        if (size_class_pools[cls] != NULL &&
+            frame_len + RTE_ETHER_CRC_LEN <= size_classes[cls].buf_size)
+            return cls;
+    return rx_size_class;
+}
+
+/* payload bytes of the largest frame of a size class */
+static inline unsigned size_class_payload(int cls)
+{
+    return size_classes[cls].buf_size - RTE_ETHER_HDR_LEN - RTE_ETHER_CRC_LEN;
+}
+
+static inline unsigned nb_packets(uint64_t nb_bytes)
+{
+    return (nb_bytes + pkt_payload_max - 1) / pkt_payload_max;
+}
+
 /* construct ping packet */
-static struct rte_mbuf *create_packet(unsigned pkt_size)
+static struct rte_mbuf *create_packet(const struct rte_ether_addr *dst, unsigned pkt_size)
 {
     struct rte_mbuf *pkt;
     struct rte_ether_hdr *eth_hdr;
+    enum size_class cls = frame_size_class(sizeof(struct rte_ether_hdr) + pkt_size);
 
-    pkt = rte_pktmbuf_alloc(pingpong_pktmbuf_pool);
+    pkt = rte_pktmbuf_alloc(size_class_pools[cls]);
     if (!pkt)
         rte_log(RTE_LOG_ERR, RTE_LOGTYPE_PINGPONG, "fail to alloc mbuf for packet\n");
 
     pkt->data_len = sizeof(struct rte_ether_hdr) + pkt_size;
+    pkt->pkt_len = pkt->data_len;
     pkt->next = NULL;
 
     /* Initialize Ethernet header. */
     eth_hdr = rte_pktmbuf_mtod(pkt, struct rte_ether_hdr *);
-    rte_ether_addr_copy(&target_ether_addr, &eth_hdr->d_addr);
+    rte_ether_addr_copy(dst, &eth_hdr->d_addr);
     rte_ether_addr_copy(&my_ether_addr, &eth_hdr->s_addr);
     eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
 
     return pkt;
 }
 
+/*
+ * Clone a template. Drivers free sent mbufs lazily, so clones of earlier
+ * messages may still sit in the TX ring: reclaim them before giving up.
+ */
+static struct rte_mbuf *clone_template(struct rte_mbuf *template)
+{
+    const uint64_t deadline_tsc = rte_rdtsc() + rte_get_tsc_hz();
+    struct rte_mbuf *m;
+
+    while ((m = rte_pktmbuf_clone(template, clone_pool)) == NULL) {
+        if (rte_rdtsc() > deadline_tsc)
+            rte_exit(EXIT_FAILURE, "fail to clone template packet\n");
+        rte_eth_tx_done_cleanup(portid, 0, 0);
+    }
+    return m;
+}
+
+/*
+ * Build packets [first, first + n) of a nb_bytes message. Every packet is a
+ * clone of a template, so all the packets of a size class share one buffer.
+ */
+static void build_packets(struct pkt_template *t, uint64_t nb_bytes,
+                          unsigned min_payload, unsigned first, unsigned n,
+                          struct rte_mbuf **pkts)
+{
+    const unsigned nb_pkts = nb_packets(nb_bytes);
+
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned payload = first + i < nb_pkts - 1 ? pkt_payload_max :
+                           nb_bytes - (uint64_t)(nb_pkts - 1) * pkt_payload_max;
+        unsigned frame_len = sizeof(struct rte_ether_hdr) + RTE_MAX(payload, min_payload);
+        struct rte_mbuf *m;
+
+        m = clone_template(t->m[frame_size_class(frame_len)]);
+        m->data_len = frame_len;
+        m->pkt_len = frame_len;
+        pkts[i] = m;
+    }
+}
+
+static void free_templates(struct pkt_template *t)
+{
+    for (int cls = 0; cls < NB_SIZE_CLASSES; ++cls)
+        if (t->m[cls] != NULL)
+            rte_pktmbuf_free(t->m[cls]);
+}
+
+static struct pkt_template ping_template;
+
+static void init_ping_template(void)
+{
+    for (int cls = 0; cls < NB_SIZE_CLASSES; ++cls)
+        if (size_class_pools[cls] != NULL)
+            ping_template.m[cls] = create_packet(&target_ether_addr,
+                                                 size_class_payload(cls));
+}
+
 /* main ping loop */
-static void ping_main_loop(uint64_t nb_bytes)
+static void ping_main_loop(uint64_t nb_bytes, struct rte_mbuf **pkts)
 {
     unsigned nb_rx, nb_tx;
     const uint64_t tsc_hz = rte_get_tsc_hz();
     struct rte_ether_hdr *eth_hdr;
     struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
 
-    unsigned nb_pkts = (nb_bytes + RTE_ETHER_MTU - 1) / RTE_ETHER_MTU;
-    struct rte_mbuf **pkts = malloc(nb_pkts * sizeof(struct rte_mbuf*));
-    for (int i = 0; i < nb_pkts - 1; ++i) {
-      pkts[i] = create_packet(RTE_ETHER_MTU);
-    }
-    pkts[nb_pkts - 1] = create_packet(nb_bytes % RTE_ETHER_MTU);
+    unsigned nb_pkts = nb_packets(nb_bytes);
+    build_packets(&ping_template, nb_bytes, 0, 0, nb_pkts, pkts);
 
     double min_tsc = 999999;
     for (int step_idx = 0; step_idx < total_steps; step_idx++)
     {
+        /* keep our reference, the driver only drops its own once sent */
+        for (int i = 0; i < nb_pkts; ++i)
+            rte_mbuf_refcnt_update(pkts[i], 1);
 
         double ping_tsc = rte_rdtsc();
         /* do ping */
@@ -194,13 +387,10 @@ static void ping_main_loop(uint64_t nb_bytes)
                 if (nb_rx + nb_rx_once > nb_pkts)
                     rte_log(RTE_LOG_WARNING, RTE_LOGTYPE_PINGPONG, "%u packets received, %u expected.\n", nb_rx + nb_rx_once, nb_pkts);
                 for (int i = 0; i < nb_rx_once; ++i) {
-                    pkts[nb_rx + i] = pkts_burst[i];
-                    eth_hdr = rte_pktmbuf_mtod(pkts[nb_rx + i], struct rte_ether_hdr *);
+                    eth_hdr = rte_pktmbuf_mtod(pkts_burst[i], struct rte_ether_hdr *);
                     /* compare mac, confirm it is a pong packet */
-                      assert(rte_is_same_ether_addr(&eth_hdr->d_addr, &my_ether_addr));
-
-                      rte_ether_addr_copy(&eth_hdr->s_addr, &eth_hdr->d_addr);
-                      rte_ether_addr_copy(&my_ether_addr, &eth_hdr->s_addr);
+                    assert(rte_is_same_ether_addr(&eth_hdr->d_addr, &my_ether_addr));
+                    rte_pktmbuf_free(pkts_burst[i]);
                 }
                 nb_rx += nb_rx_once;
             }
@@ -216,19 +406,17 @@ static void ping_main_loop(uint64_t nb_bytes)
     for (int i = 0; i < nb_pkts; ++i) {
       rte_pktmbuf_free(pkts[i]);
     }
-    free(pkts);
 }
 
 /* main pong loop */
-static void pong_main_loop(uint64_t nb_bytes)
+static void pong_main_loop(uint64_t nb_bytes, struct rte_mbuf **pkts)
 {
     unsigned nb_rx, nb_tx;
     struct rte_mbuf *m = NULL;
     struct rte_ether_hdr *eth_hdr;
     struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
 
-    unsigned nb_pkts = (nb_bytes + RTE_ETHER_MTU - 1) / RTE_ETHER_MTU;
-    struct rte_mbuf **pkts = malloc(nb_pkts * sizeof(struct rte_mbuf*));
+    unsigned nb_pkts = nb_packets(nb_bytes);
 
     /* wait for pong */
     for (int step_idx = 0; step_idx < total_steps; step_idx++)
@@ -264,7 +452,254 @@ static void pong_main_loop(uint64_t nb_bytes)
         nb_tx += rte_eth_tx_burst(portid, 0, pkts + nb_tx, nb_pkts - nb_tx);
       }
     }
-    free(pkts);
+}
+
+/* read the peer MAC addresses, one per line */
+static void coll_read_peers(const char *filename)
+{
+    char line[64];
+    FILE *fp = fopen(filename, "r");
+
+    if (fp == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot open MAC list file %s\n", filename);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct rte_ether_addr *addr = &coll_peers[coll_nb_peers];
+        const char* PARSE_STRING = "%02hhX:%02hhX:%02hhX:%02hhX:%02hhX:%02hhX";
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (coll_nb_peers == COLL_MAX_PEERS)
+            rte_exit(EXIT_FAILURE, "Too many peers in %s, at most %u\n",
+                     filename, COLL_MAX_PEERS);
+        if (sscanf(line, PARSE_STRING,
+                   &addr->addr_bytes[0],
+                   &addr->addr_bytes[1],
+                   &addr->addr_bytes[2],
+                   &addr->addr_bytes[3],
+                   &addr->addr_bytes[4],
+                   &addr->addr_bytes[5]) != RTE_ETHER_ADDR_LEN)
+            rte_exit(EXIT_FAILURE, "Invalid MAC address in %s: %s", filename, line);
+        coll_nb_peers++;
+    }
+    fclose(fp);
+
+    if (coll_nb_peers < 2)
+        rte_exit(EXIT_FAILURE, "Need at least 2 peers in %s\n", filename);
+}
+
+static inline uint64_t coll_all_peers_mask(void)
+{
+    uint64_t all = coll_nb_peers == 64 ? UINT64_MAX : (1ULL << coll_nb_peers) - 1;
+    return all & ~(1ULL << coll_rank);
+}
+
+static struct rte_mbuf *coll_create_packet(unsigned dst_rank, uint16_t type,
+                                           unsigned pkt_size)
+{
+    struct rte_mbuf *pkt;
+    struct rte_ether_hdr *eth_hdr;
+    struct coll_hdr *hdr;
+
+    pkt = create_packet(&coll_peers[dst_rank],
+                        RTE_MAX(pkt_size, (unsigned)sizeof(struct coll_hdr)));
+    eth_hdr = rte_pktmbuf_mtod(pkt, struct rte_ether_hdr *);
+    eth_hdr->ether_type = rte_cpu_to_be_16(COLL_ETHER_TYPE);
+
+    hdr = (struct coll_hdr *)(eth_hdr + 1);
+    hdr->src_rank = rte_cpu_to_be_16(coll_rank);
+    hdr->type = rte_cpu_to_be_16(type);
+    hdr->heard_mask = rte_cpu_to_be_64(coll_heard_mask);
+    return pkt;
+}
+
+static void coll_init_templates(void)
+{
+    for (unsigned rank = 0; rank < coll_nb_peers; ++rank)
+        for (int cls = 0; cls < NB_SIZE_CLASSES; ++cls)
+            if (rank != coll_rank && size_class_pools[cls] != NULL)
+                coll_templates[rank].m[cls] =
+                    coll_create_packet(rank, COLL_PKT_DATA, size_class_payload(cls));
+}
+
+static void coll_send_hello(unsigned dst_rank, uint16_t type)
+{
+    struct rte_mbuf *pkt = coll_create_packet(dst_rank, type, 0);
+
+    if (rte_eth_tx_burst(portid, 0, &pkt, 1) == 0)
+        rte_pktmbuf_free(pkt);
+}
+
+/*
+ * Receive whatever has arrived: credit data packets to their sender and
+ * track hellos. A peer only sends HELLOs while it does not know that we
+ * heard from it, so every HELLO is answered, also after our own barrier.
+ */
+static void coll_poll(void)
+{
+    struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
+    struct rte_ether_hdr *eth_hdr;
+    struct coll_hdr *hdr;
+    unsigned nb_rx = rte_eth_rx_burst(portid, 0, pkts_burst, MAX_PKT_BURST);
+
+    for (unsigned i = 0; i < nb_rx; ++i) {
+        eth_hdr = rte_pktmbuf_mtod(pkts_burst[i], struct rte_ether_hdr *);
+        hdr = (struct coll_hdr *)(eth_hdr + 1);
+        if (eth_hdr->ether_type == rte_cpu_to_be_16(COLL_ETHER_TYPE) &&
+            rte_be_to_cpu_16(hdr->src_rank) < coll_nb_peers) {
+            unsigned src_rank = rte_be_to_cpu_16(hdr->src_rank);
+
+            uint16_t type = rte_be_to_cpu_16(hdr->type);
+
+            if (type == COLL_PKT_DATA) {
+                coll_credits[src_rank]++;
+            } else {
+                coll_heard_mask |= 1ULL << src_rank;
+                if (rte_be_to_cpu_64(hdr->heard_mask) & (1ULL << coll_rank))
+                    coll_known_mask |= 1ULL << src_rank;
+                if (type == COLL_PKT_HELLO)
+                    coll_send_hello(src_rank, COLL_PKT_HELLO_REPLY);
+            }
+        }
+        rte_pktmbuf_free(pkts_burst[i]);
+    }
+}
+
+/* wait until every peer has heard from us and we have heard from every peer */
+static void coll_barrier(void)
+{
+    const uint64_t all = coll_all_peers_mask();
+    const uint64_t hello_interval = rte_get_tsc_hz() * COLL_HELLO_INTERVAL_MS / MS_PER_S;
+    uint64_t next_hello_tsc = 0;
+
+    while (coll_heard_mask != all || coll_known_mask != all) {
+        if (rte_rdtsc() >= next_hello_tsc) {
+            for (unsigned rank = 0; rank < coll_nb_peers; ++rank)
+                if (rank != coll_rank && !(coll_known_mask & (1ULL << rank)))
+                    coll_send_hello(rank, COLL_PKT_HELLO);
+            next_hello_tsc = rte_rdtsc() + hello_interval;
+        }
+        coll_poll();
+    }
+}
+
+/* send nb_bytes to a peer, packetized like the ping messages */
+static void coll_send(unsigned dst_rank, uint64_t nb_bytes)
+{
+    struct rte_mbuf *pkts[MAX_PKT_BURST];
+    unsigned nb_pkts = nb_packets(nb_bytes);
+    unsigned nb_sent = 0;
+
+    while (nb_sent < nb_pkts) {
+        unsigned n = RTE_MIN(nb_pkts - nb_sent, (unsigned)MAX_PKT_BURST);
+        unsigned nb_tx = 0;
+
+        build_packets(&coll_templates[dst_rank], nb_bytes,
+                      sizeof(struct coll_hdr), nb_sent, n, pkts);
+        while (nb_tx < n) {
+            nb_tx += rte_eth_tx_burst(portid, 0, pkts + nb_tx, n - nb_tx);
+            /* keep draining RX so that incoming data is not dropped */
+            coll_poll();
+        }
+        nb_sent += n;
+    }
+}
+
+/* wait for nb_bytes from a peer */
+static void coll_recv(unsigned src_rank, uint64_t nb_bytes)
+{
+    unsigned nb_pkts = nb_packets(nb_bytes);
+    const uint64_t timeout = rte_get_tsc_hz() * COLL_RECV_TIMEOUT_MS / MS_PER_S;
+    uint64_t deadline_tsc = rte_rdtsc() + timeout;
+    uint64_t last_credits = coll_credits[src_rank];
+
+    while (coll_credits[src_rank] < nb_pkts) {
+        coll_poll();
+        /* raw Ethernet does not retransmit, a lost frame never shows up */
+        if (coll_credits[src_rank] != last_credits) {
+            last_credits = coll_credits[src_rank];
+            deadline_tsc = rte_rdtsc() + timeout;
+        } else if (rte_rdtsc() > deadline_tsc) {
+            struct rte_eth_stats stats;
+
+            rte_eth_stats_get(portid, &stats);
+            rte_exit(EXIT_FAILURE,
+                     "rank %u: %" PRIu64 " of %u packets from rank %u missing "
+                     "after %u ms, port %u imissed %" PRIu64 " ierrors %" PRIu64
+                     " rx_nombuf %" PRIu64 "\n",
+                     coll_rank, nb_pkts - coll_credits[src_rank], nb_pkts,
+                     src_rank, COLL_RECV_TIMEOUT_MS, portid, stats.imissed,
+                     stats.ierrors, stats.rx_nombuf);
+        }
+    }
+    coll_credits[src_rank] -= nb_pkts;
+}
+
+/*
+ * Ring allreduce traffic: the message is cut into one chunk per rank, and
+ * 2 * (N - 1) steps of reduce-scatter then allgather each pass one chunk
+ * to the next rank. The reduction itself is not computed.
+ */
+static void coll_ring_allreduce(uint64_t nb_bytes)
+{
+    const uint64_t chunk = (nb_bytes + coll_nb_peers - 1) / coll_nb_peers;
+    const unsigned next = (coll_rank + 1) % coll_nb_peers;
+    const unsigned prev = (coll_rank + coll_nb_peers - 1) % coll_nb_peers;
+
+    for (unsigned step = 0; step < 2 * (coll_nb_peers - 1); ++step) {
+        coll_send(next, chunk);
+        coll_recv(prev, chunk);
+    }
+}
+
+/* all-to-all: every rank sends a distinct chunk to every other rank */
+static void coll_alltoall(uint64_t nb_bytes)
+{
+    const uint64_t chunk = (nb_bytes + coll_nb_peers - 1) / coll_nb_peers;
+
+    for (unsigned k = 1; k < coll_nb_peers; ++k)
+        coll_send((coll_rank + k) % coll_nb_peers, chunk);
+    for (unsigned k = 1; k < coll_nb_peers; ++k)
+        coll_recv((coll_rank + coll_nb_peers - k) % coll_nb_peers, chunk);
+}
+
+/* time total_steps back-to-back collectives of each message size */
+static void coll_main_loop(const char *name, void (*coll)(uint64_t))
+{
+    const uint64_t tsc_hz = rte_get_tsc_hz();
+
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG,
+            "running %s over %u ranks\n", name, coll_nb_peers);
+    for (uint64_t nb_bytes = nb_bytes_min; nb_bytes <= nb_bytes_max; nb_bytes *= 2)
+    {
+        double start_tsc = rte_rdtsc();
+        for (int step_idx = 0; step_idx < total_steps; step_idx++)
+            coll(nb_bytes);
+        double end_tsc = rte_rdtsc();
+        double time_us = (end_tsc - start_tsc) * US_PER_S / tsc_hz / total_steps;
+        /* algorithmic bandwidth: message size over time per collective */
+        printf("%lu %.2f %.2f\n", nb_bytes, time_us, nb_bytes * 8. / time_us);
+    }
+}
+
+static int coll_launch_one_lcore(__attribute__((unused)) void *dummy)
+{
+    unsigned lcore_id;
+    lcore_id = rte_lcore_id();
+
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG,
+            "entering collective loop on lcore %u as rank %u of %u\n",
+            lcore_id, coll_rank, coll_nb_peers);
+    coll_init_templates();
+    coll_barrier();
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG, "all %u ranks are up\n", coll_nb_peers);
+    if (coll_run_ring)
+        coll_main_loop("ring allreduce", coll_ring_allreduce);
+    if (coll_run_alltoall)
+        coll_main_loop("all-to-all", coll_alltoall);
+    for (unsigned rank = 0; rank < coll_nb_peers; ++rank)
+        free_templates(&coll_templates[rank]);
+    return 0;
 }
 
 static int ping_launch_one_lcore(__attribute__((unused)) void *dummy)
@@ -282,8 +717,18 @@ static int ping_launch_one_lcore(__attribute__((unused)) void *dummy)
             target_ether_addr.addr_bytes[3],
             target_ether_addr.addr_bytes[4],
             target_ether_addr.addr_bytes[5]);
+
+    /* one array for the largest message, reused by every size */
+    struct rte_mbuf **pkts = rte_zmalloc_socket("ping_pkts",
+                                                nb_packets(nb_bytes_max) * sizeof(struct rte_mbuf *),
+                                                RTE_CACHE_LINE_SIZE, rte_socket_id());
+    if (pkts == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate packet array\n");
+    init_ping_template();
     for (uint64_t nb_bytes = nb_bytes_min; nb_bytes <= nb_bytes_max; nb_bytes *= 2)
-        ping_main_loop(nb_bytes);
+        ping_main_loop(nb_bytes, pkts);
+    free_templates(&ping_template);
+    rte_free(pkts);
     return 0;
 }
 
@@ -294,16 +739,137 @@ static int pong_launch_one_lcore(__attribute__((unused)) void *dummy)
 
     rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG, "entering pong loop on lcore %u\n", lcore_id);
     rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG, "waiting ping packets\n");
+
+    /* one array for the largest message, reused by every size */
+    struct rte_mbuf **pkts = rte_zmalloc_socket("pong_pkts",
+                                                nb_packets(nb_bytes_max) * sizeof(struct rte_mbuf *),
+                                                RTE_CACHE_LINE_SIZE, rte_socket_id());
+    if (pkts == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate packet array\n");
     for (uint64_t nb_bytes = nb_bytes_min; nb_bytes <= nb_bytes_max; nb_bytes *= 2)
-        pong_main_loop(nb_bytes);
+        pong_main_loop(nb_bytes, pkts);
+    rte_free(pkts);
+    return 0;
+}
+
+/* a per-lcore cache only where the pool is large enough for one */
+static unsigned pool_cache_size(unsigned nb_mbufs)
+{
+    return nb_mbufs >= MEMPOOL_CACHE_SIZE * 3 / 2 ? MEMPOOL_CACHE_SIZE : 0;
+}
+
+static struct rte_mempool *create_size_class_pool(int cls, unsigned nb_mbufs)
+{
+    char name[RTE_MEMPOOL_NAMESIZE];
+    struct rte_mempool *mp;
+
+    snprintf(name, sizeof(name), "mbuf_pool_%s", size_classes[cls].name);
+    mp = rte_pktmbuf_pool_create(name, nb_mbufs, pool_cache_size(nb_mbufs), 0,
+                                 RTE_PKTMBUF_HEADROOM + size_classes[cls].buf_size,
+                                 rte_socket_id());
+    if (mp == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot init %s mbuf pool\n", size_classes[cls].name);
+    return mp;
+}
+
+/* size every pool from what this run can hold at once */
+static void init_pools(void)
+{
+    /* packets of one message held by the application */
+    const unsigned window = coll_file != NULL ? MAX_PKT_BURST : nb_packets(nb_bytes_max);
+    /* one template per destination and size class on the sending side */
+    const unsigned nb_dsts = coll_file != NULL ? coll_nb_peers - 1 : server_mode ? 0 : 1;
+    unsigned nb_small = nb_dsts;
+    unsigned nb_rx_mbufs = nb_rxd + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE + nb_dsts;
+    unsigned nb_clones;
+
+    /*
+     * Ping and collective sides free received frames right away and send
+     * clones; only the pong side holds RX mbufs in its window and TX ring.
+     */
+    if (server_mode && coll_file == NULL)
+        nb_rx_mbufs += nb_txd + window;
+    size_class_pools[rx_size_class] = create_size_class_pool(rx_size_class, nb_rx_mbufs);
+
+    /* hellos are built from the small class */
+    if (coll_file != NULL)
+        nb_small += nb_txd + MAX_PKT_BURST;
+    if (nb_small > 0)
+        size_class_pools[SIZE_CLASS_SMALL] = create_size_class_pool(SIZE_CLASS_SMALL, nb_small);
+
+    if (nb_dsts > 0) {
+        /*
+         * Clones of the message being built, plus the ones of earlier
+         * messages the TX ring may not have released yet.
+         */
+        nb_clones = window + nb_txd + MAX_PKT_BURST;
+        clone_pool = rte_pktmbuf_pool_create("mbuf_pool_clone", nb_clones,
+                                             pool_cache_size(nb_clones), 0, 0,
+                                             rte_socket_id());
+        if (clone_pool == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot init clone mbuf pool\n");
+    }
+}
+
+static void mempool_mem_cb(__attribute__((unused)) struct rte_mempool *mp, void *opaque,
+                           struct rte_mempool_memhdr *memhdr,
+                           __attribute__((unused)) unsigned mem_idx)
+{
+    *(size_t *)opaque += memhdr->len;
+}
+
+struct memseg_usage {
+    size_t bytes;
+    unsigned nb_pages;
+    uint64_t page_sz;
+};
+
+static int memseg_cb(const struct rte_memseg_list *msl,
+                     const struct rte_memseg *ms, void *arg)
+{
+    struct memseg_usage *usage = arg;
+
+    usage->bytes += ms->len;
+    usage->nb_pages++;
+    usage->page_sz = msl->page_sz;
     return 0;
 }
 
+static void print_footprint(void)
+{
+    struct rte_mempool *pools[NB_SIZE_CLASSES + 1];
+    struct memseg_usage usage = { 0 };
+    size_t total = 0;
+
+    for (int cls = 0; cls < NB_SIZE_CLASSES; ++cls)
+        pools[cls] = size_class_pools[cls];
+    pools[NB_SIZE_CLASSES] = clone_pool;
+
+    for (int i = 0; i < NB_SIZE_CLASSES + 1; ++i) {
+        size_t bytes = 0;
+
+        if (pools[i] == NULL)
+            continue;
+        rte_mempool_mem_iter(pools[i], mempool_mem_cb, &bytes);
+        rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG,
+                "%s: %u mbufs of %u bytes, %zu bytes\n", pools[i]->name,
+                pools[i]->size,
+                pools[i]->header_size + pools[i]->elt_size + pools[i]->trailer_size,
+                bytes);
+        total += bytes;
+    }
+
+    rte_memseg_walk(memseg_cb, &usage);
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_PINGPONG,
+            "mempools use %zu bytes of %zu bytes of DPDK memory "
+            "(%u pages of %" PRIu64 " kB)\n",
+            total, usage.bytes, usage.nb_pages, usage.page_sz / 1024);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
     uint16_t nb_ports;
-    unsigned int nb_mbufs;
     unsigned int lcore_id;
 
     /* init EAL */
@@ -333,13 +899,6 @@ int main(int argc, char **argv)
     if (portid > nb_ports - 1)
         rte_exit(EXIT_FAILURE, "Invalid port id %u, port id should be in range [0, %u]\n", portid, nb_ports - 1);
 
-    nb_mbufs = RTE_MAX((unsigned int)(nb_ports * (nb_rxd + nb_txd + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE)), 8192U);
-    pingpong_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", nb_mbufs,
-                                                    MEMPOOL_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
-                                                    rte_socket_id());
-    if (pingpong_pktmbuf_pool == NULL)
-        rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
-
     struct rte_eth_rxconf rxq_conf;
     struct rte_eth_txconf txq_conf;
     struct rte_eth_conf local_port_conf = port_conf;
@@ -350,9 +909,22 @@ int main(int argc, char **argv)
 
     /* init port */
     rte_eth_dev_info_get(portid, &dev_info);
-    if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
+    /*
+     * The pong side echoes RX mbufs of a single pool with refcnt 1. The
+     * ping and collective sides send clones from several pools, the ping
+     * ones with refcnt > 1, so they cannot use fast free.
+     */
+    if (server_mode && coll_file == NULL &&
+        (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE))
         local_port_conf.txmode.offloads |=
             DEV_TX_OFFLOAD_MBUF_FAST_FREE;
+    if (jumbo_mode) {
+        if (!(dev_info.rx_offload_capa & DEV_RX_OFFLOAD_JUMBO_FRAME) ||
+            dev_info.max_rx_pktlen < JUMBO_FRAME_LEN)
+            rte_exit(EXIT_FAILURE, "Port %u does not support jumbo frames\n", portid);
+        local_port_conf.rxmode.max_rx_pkt_len = JUMBO_FRAME_LEN;
+        local_port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME;
+    }
 
     ret = rte_eth_dev_configure(portid, 1, 1, &local_port_conf);
     if (ret < 0)
@@ -380,6 +952,20 @@ int main(int argc, char **argv)
                "Cannot get MAC address: err=%d, port=%u\n",
                ret, portid);
 
+    if (coll_file != NULL) {
+        coll_read_peers(coll_file);
+        for (coll_rank = 0; coll_rank < coll_nb_peers; ++coll_rank)
+            if (rte_is_same_ether_addr(&coll_peers[coll_rank], &my_ether_addr))
+                break;
+        if (coll_rank == coll_nb_peers)
+            rte_exit(EXIT_FAILURE, "My MAC address is not in %s\n", coll_file);
+        rte_log(RTE_LOG_DEBUG, RTE_LOGTYPE_PINGPONG, "rank %u of %u\n",
+                coll_rank, coll_nb_peers);
+    }
+
+    init_pools();
+    print_footprint();
+
     /* init one RX queue */
     fflush(stdout);
     rxq_conf = dev_info.default_rxconf;
@@ -388,7 +974,7 @@ int main(int argc, char **argv)
     ret = rte_eth_rx_queue_setup(portid, 0, nb_rxd,
                                  rte_eth_dev_socket_id(portid),
                                  &rxq_conf,
-                                 pingpong_pktmbuf_pool);
+                                 size_class_pools[rx_size_class]);
     if (ret < 0)
         rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
                  ret, portid);
@@ -420,7 +1006,11 @@ int main(int argc, char **argv)
     lcore_id = rte_get_next_lcore(0, true, false);
 
     ret = 0;
-    if (server_mode)
+    if (coll_file != NULL)
+    {
+        rte_eal_remote_launch(coll_launch_one_lcore, NULL, lcore_id);
+    }
+    else if (server_mode)
     {
         rte_eal_remote_launch(pong_launch_one_lcore, NULL, lcore_id);
     }
@@ -1,5 +1,7 @@
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 #include <getopt.h>
 
 #include <rte_byteorder.h>
@@ -12,6 +14,9 @@
 #include <rte_mbuf.h>
 #include <rte_malloc.h>
 #include <rte_ether.h>
+#include <rte_ring.h>
+#include <rte_cycles.h>
+#include <rte_mbuf_dyn.h>
 
 #define APP "dpu_fwd"
 
@@ -37,6 +42,118 @@ struct rte_mempool *dpu_fwd_pktmbuf_pool = NULL;
 
 static volatile bool force_quit;
 
+/*
+ * Sampled packet capture tap.
+ * Selected packets are cloned (by reference, not copied) into a ring that
+ * a dedicated lcore drains into a pcap file. Forwarding lcores never wait
+ * on the tap: a sample is dropped if the clone pool or the ring is full.
+ */
+#define CAPTURE_SAMPLE_RATE_DEFAULT 1000
+#define CAPTURE_RING_SIZE_DEFAULT 1024
+#define CAPTURE_SNAPLEN_DEFAULT 128
+#define CAPTURE_SNAPLEN_MAX 65535
+/* nanosecond-resolution pcap, LINKTYPE_ETHERNET */
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/* output pcap file, capture is disabled when NULL */
+static const char *capture_file = NULL;
+/* mirror 1-in-N of the packets that pass the filters */
+static uint32_t capture_sample_rate = CAPTURE_SAMPLE_RATE_DEFAULT;
+/* ethertype filter, 0 matches any */
+static uint16_t capture_ether_type = 0;
+/* MAC filter, matches either source or destination */
+static bool capture_mac_filter = false;
+static struct rte_ether_addr capture_mac;
+/* maximum number of in-flight samples, bounds the tap memory */
+static uint32_t capture_ring_size = CAPTURE_RING_SIZE_DEFAULT;
+static uint32_t capture_snaplen = CAPTURE_SNAPLEN_DEFAULT;
+
+static struct rte_ring *capture_ring = NULL;
+static struct rte_mempool *capture_clone_pool = NULL;
+static FILE *capture_fp = NULL;
+static uint64_t capture_written = 0;
+static uint64_t capture_base_tsc;
+static struct timespec capture_base_ts;
+
+/*
+ * Optional traffic shaper.
+ * Each lcore is the only sender on its output port, so it owns that port's
+ * shaper. Frames up to shaper_prio_size bytes go to a strict-priority lane,
+ * everything else to the bulk lane. A token bucket limits the port, another
+ * one limits the bulk lane; a rate of 0 means unlimited.
+ */
+#define SHAPER_QUEUE_DEPTH_DEFAULT 1024
+#define SHAPER_PRIO_SIZE_DEFAULT 128
+/* bucket depth, in microseconds worth of traffic at the configured rate */
+#define SHAPER_BURST_US 100
+/* per-frame wire bytes not in pkt_len: preamble 8, IFG 12, CRC 4 */
+#define SHAPER_FRAME_OVERHEAD_DEFAULT 24
+
+enum shaper_class {
+    SHAPER_CLASS_PRIO,
+    SHAPER_CLASS_BULK,
+    SHAPER_NB_CLASSES
+};
+
+static const char *shaper_class_names[SHAPER_NB_CLASSES] = {
+    "prio",
+    "bulk",
+};
+
+static bool shaper_enabled = false;
+static uint64_t shaper_port_rate_mbps = 0;
+static uint64_t shaper_bulk_rate_mbps = 0;
+static uint32_t shaper_prio_size = SHAPER_PRIO_SIZE_DEFAULT;
+static uint32_t shaper_queue_depth = SHAPER_QUEUE_DEPTH_DEFAULT;
+static uint32_t shaper_frame_overhead = SHAPER_FRAME_OVERHEAD_DEFAULT;
+
+struct token_bucket {
+    double tokens;         /* bytes */
+    double size;           /* bytes */
+    double bytes_per_tsc;  /* 0 if unlimited */
+    uint64_t last_tsc;
+};
+
+/* single-producer single-consumer FIFO, local to one lcore */
+struct shaper_queue {
+    struct rte_mbuf **pkts;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t mask;
+};
+
+struct shaper {
+    struct token_bucket port_tb;
+    struct token_bucket class_tb[SHAPER_NB_CLASSES];
+    struct shaper_queue queue[SHAPER_NB_CLASSES];
+};
+
+/* RX timestamp (TSC) of a packet, kept in an mbuf dynamic field */
+static int rx_tsc_dynfield_offset = -1;
+
+static inline uint64_t *rx_tsc_field(struct rte_mbuf *m)
+{
+    return RTE_MBUF_DYNFIELD(m, rx_tsc_dynfield_offset, uint64_t *);
+}
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_pkt_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
 static struct rte_eth_conf port_conf = {
     .rxmode = {
         .split_hdr_size = 0,
@@ -50,6 +167,14 @@ static struct rte_eth_conf port_conf = {
 struct dpu_fwd_stat {
     uint64_t recv;
     uint64_t sent;
+    uint64_t captured;
+    uint64_t cap_dropped;
+    /* per shaper class */
+    uint64_t cls_enq[SHAPER_NB_CLASSES];
+    uint64_t cls_sent[SHAPER_NB_CLASSES];
+    uint64_t cls_dropped[SHAPER_NB_CLASSES];
+    uint64_t cls_delay_tsc[SHAPER_NB_CLASSES];
+    uint64_t cls_delay_max_tsc[SHAPER_NB_CLASSES];
 } __rte_cache_aligned;
 
 pthread_spinlock_t stat_spinlock;
@@ -59,6 +184,15 @@ static inline void initlize_statistics(struct dpu_fwd_stat *stat)
 {
     stat->recv = 0;
     stat->sent = 0;
+    stat->captured = 0;
+    stat->cap_dropped = 0;
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls) {
+        stat->cls_enq[cls] = 0;
+        stat->cls_sent[cls] = 0;
+        stat->cls_dropped[cls] = 0;
+        stat->cls_delay_tsc[cls] = 0;
+        stat->cls_delay_max_tsc[cls] = 0;
+    }
 }
 
 static inline void destroy_statistics(struct dpu_fwd_stat *stat)
@@ -73,6 +207,154 @@ static inline void print_statistics(struct dpu_fwd_stat *stat)
             "sent %" PRIu64 " packets\n"
             "============================\n",
             stat->recv, stat->sent);
+    if (capture_file != NULL)
+        rte_log(RTE_LOG_INFO, RTE_LOGTYPE_DPU_FWD,
+                "==== capture statistics ====\n"
+                "sampled %" PRIu64 " packets\n"
+                "dropped %" PRIu64 " samples\n"
+                "written %" PRIu64 " packets to %s\n"
+                "============================\n",
+                stat->captured, stat->cap_dropped,
+                capture_written, capture_file);
+    if (shaper_enabled) {
+        const double tsc_per_us = (double)rte_get_tsc_hz() / US_PER_S;
+        for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls)
+            rte_log(RTE_LOG_INFO, RTE_LOGTYPE_DPU_FWD,
+                    "shaper class %s: enqueued %" PRIu64 " sent %" PRIu64
+                    " dropped %" PRIu64 " queueing delay avg %.2f us "
+                    "max %.2f us\n",
+                    shaper_class_names[cls], stat->cls_enq[cls],
+                    stat->cls_sent[cls], stat->cls_dropped[cls],
+                    stat->cls_sent[cls] ?
+                        stat->cls_delay_tsc[cls] / tsc_per_us /
+                        stat->cls_sent[cls] : 0.,
+                    stat->cls_delay_max_tsc[cls] / tsc_per_us);
+    }
+}
+
+static const char short_options[] =
+    "w:" /* capture file */
+    "n:" /* capture 1-in-N packets */
+    "t:" /* capture ethertype filter */
+    "a:" /* capture MAC filter */
+    "q:" /* capture ring size */
+    "s:" /* capture snap length */
+    "R:" /* shaper port rate */
+    "B:" /* shaper bulk class rate */
+    "P:" /* shaper priority frame size */
+    "d:" /* shaper queue depth */
+    "O:" /* shaper frame overhead */
+    ;
+
+/* display usage */
+static void dpu_fwd_usage(const char *prgname)
+{
+    printf("%s [EAL options] --"
+           "\t-w FILE: capture sampled packets into a pcap file\n"
+           "\t-n N: capture 1-in-N matching packets (default %u)\n"
+           "\t-t ETHERTYPE: only capture packets of this ethertype\n"
+           "\t-a MAC: only capture packets from/to this MAC address\n"
+           "\t-q SIZE: maximum number of in-flight samples (default %u)\n"
+           "\t-s BYTES: capture snap length (default %u)\n"
+           "\t-R MBPS: shape each output port to this rate\n"
+           "\t-B MBPS: shape the bulk class of each output port to this rate\n"
+           "\t-P BYTES: frames up to this size use the priority lane (default %u)\n"
+           "\t-d PKTS: shaper queue depth per class (default %u)\n"
+           "\t-O BYTES: wire overhead charged per frame by the shaper (default %u)\n",
+           prgname, CAPTURE_SAMPLE_RATE_DEFAULT, CAPTURE_RING_SIZE_DEFAULT,
+           CAPTURE_SNAPLEN_DEFAULT, SHAPER_PRIO_SIZE_DEFAULT,
+           SHAPER_QUEUE_DEPTH_DEFAULT, SHAPER_FRAME_OVERHEAD_DEFAULT);
+}
+
+/* Parse the argument given in the command line of the application */
+static int dpu_fwd_parse_args(int argc, char **argv)
+{
+    int opt, ret;
+    char *prgname = argv[0];
+
+    while ((opt = getopt(argc, argv, short_options)) != EOF)
+    {
+        switch (opt)
+        {
+        case 'w':
+            capture_file = optarg;
+            break;
+
+        case 'n':
+            capture_sample_rate = (uint32_t)strtoul(optarg, NULL, 10);
+            if (capture_sample_rate == 0)
+                capture_sample_rate = 1;
+            break;
+
+        case 't':
+            capture_ether_type = (uint16_t)strtoul(optarg, NULL, 0);
+            break;
+
+        case 'a': {
+            const char* PARSE_STRING = "%02hhX:%02hhX:%02hhX:%02hhX:%02hhX:%02hhX";
+            if (sscanf(optarg, PARSE_STRING,
+                       &capture_mac.addr_bytes[0],
+                       &capture_mac.addr_bytes[1],
+                       &capture_mac.addr_bytes[2],
+                       &capture_mac.addr_bytes[3],
+                       &capture_mac.addr_bytes[4],
+                       &capture_mac.addr_bytes[5]) != RTE_ETHER_ADDR_LEN) {
+                printf("Invalid capture MAC address: %s\n", optarg);
+                dpu_fwd_usage(prgname);
+                return -1;
+            }
+            capture_mac_filter = true;
+            break;
+        }
+
+        case 'q':
+            capture_ring_size = rte_align32pow2((uint32_t)strtoul(optarg, NULL, 10));
+            if (capture_ring_size < 2)
+                capture_ring_size = 2;
+            break;
+
+        case 's':
+            capture_snaplen = (uint32_t)strtoul(optarg, NULL, 10);
+            if (capture_snaplen == 0 || capture_snaplen > CAPTURE_SNAPLEN_MAX)
+                capture_snaplen = CAPTURE_SNAPLEN_MAX;
+            break;
+
+        case 'R':
+            shaper_port_rate_mbps = (uint64_t)strtoull(optarg, NULL, 10);
+            break;
+
+        case 'B':
+            shaper_bulk_rate_mbps = (uint64_t)strtoull(optarg, NULL, 10);
+            break;
+
+        case 'P':
+            shaper_prio_size = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+
+        case 'd':
+            shaper_queue_depth = rte_align32pow2((uint32_t)strtoul(optarg, NULL, 10));
+            if (shaper_queue_depth < MAX_PKT_BURST)
+                shaper_queue_depth = MAX_PKT_BURST;
+            break;
+
+        case 'O':
+            shaper_frame_overhead = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+
+        default:
+            dpu_fwd_usage(prgname);
+            return -1;
+        }
+    }
+
+    shaper_enabled = shaper_port_rate_mbps != 0 || shaper_bulk_rate_mbps != 0;
+
+    if (optind >= 0)
+        argv[optind - 1] = prgname;
+
+    ret = optind - 1;
+    optind = 1; /* reset getopt lib */
+    return ret;
 }
 
 static void signal_handler(int signum)
@@ -84,6 +366,351 @@ static void signal_handler(int signum)
     }
 }
 
+static void init_rx_tsc_dynfield(void)
+{
+    static const struct rte_mbuf_dynfield rx_tsc_dynfield_desc = {
+        .name = "dpu_fwd_dynfield_rx_tsc",
+        .size = sizeof(uint64_t),
+        .align = __alignof__(uint64_t),
+    };
+
+    rx_tsc_dynfield_offset = rte_mbuf_dynfield_register(&rx_tsc_dynfield_desc);
+    if (rx_tsc_dynfield_offset < 0)
+        rte_exit(EXIT_FAILURE, "Cannot register RX timestamp field: %s\n",
+                 rte_strerror(rte_errno));
+}
+
+/* set up the clone pool, the sample ring and the pcap file */
+static void init_capture(void)
+{
+    struct pcap_file_hdr file_hdr;
+
+    /*
+     * Every in-flight sample holds one indirect mbuf from this pool. No
+     * per-lcore cache: clones are allocated by the forwarding lcores and
+     * freed by the writer, and the pool size must be a hard bound.
+     */
+    capture_clone_pool = rte_pktmbuf_pool_create("capture_clone_pool",
+                                                 capture_ring_size, 0, 0, 0,
+                                                 rte_socket_id());
+    if (capture_clone_pool == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot init capture clone pool\n");
+
+    capture_ring = rte_ring_create("capture_ring", capture_ring_size,
+                                   rte_socket_id(), RING_F_SC_DEQ);
+    if (capture_ring == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create capture ring: %s\n",
+                 rte_strerror(rte_errno));
+
+    capture_fp = fopen(capture_file, "w");
+    if (capture_fp == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot open capture file %s\n", capture_file);
+
+    file_hdr.magic = PCAP_MAGIC_NSEC;
+    file_hdr.version_major = 2;
+    file_hdr.version_minor = 4;
+    file_hdr.thiszone = 0;
+    file_hdr.sigfigs = 0;
+    file_hdr.snaplen = capture_snaplen;
+    file_hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+    if (fwrite(&file_hdr, sizeof(file_hdr), 1, capture_fp) != 1)
+        rte_exit(EXIT_FAILURE, "Cannot write capture file %s\n", capture_file);
+
+    /* map TSC timestamps to wall clock time */
+    clock_gettime(CLOCK_REALTIME, &capture_base_ts);
+    capture_base_tsc = rte_rdtsc();
+
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_DPU_FWD,
+            "capture to %s: 1-in-%u packets, ethertype 0x%04x, "
+            "up to %u samples in flight (%zu bytes of clones, "
+            "pinning up to %u packet buffers)\n",
+            capture_file, capture_sample_rate, capture_ether_type,
+            capture_ring_size - 1,
+            (size_t)capture_ring_size * capture_clone_pool->elt_size,
+            capture_ring_size);
+}
+
+static inline bool capture_match(struct rte_mbuf *m)
+{
+    struct rte_ether_hdr *eth_hdr;
+
+    if (capture_ether_type == 0 && !capture_mac_filter)
+        return true;
+
+    eth_hdr = rte_pktmbuf_mtod(m, struct rte_ether_hdr *);
+    if (capture_ether_type != 0 &&
+        eth_hdr->ether_type != rte_cpu_to_be_16(capture_ether_type))
+        return false;
+    if (capture_mac_filter &&
+        !rte_is_same_ether_addr(&eth_hdr->d_addr, &capture_mac) &&
+        !rte_is_same_ether_addr(&eth_hdr->s_addr, &capture_mac))
+        return false;
+    return true;
+}
+
+/* mirror the selected packets of a received burst, never blocks */
+static inline void capture_burst(struct rte_mbuf **pkts, uint16_t nb_pkts,
+                                 uint32_t *countdown,
+                                 struct dpu_fwd_stat *stat)
+{
+    struct rte_mbuf *clones[MAX_PKT_BURST];
+    struct rte_mbuf *clone;
+    unsigned nb_clones = 0;
+    unsigned nb_enq;
+    uint64_t rx_tsc = rte_rdtsc();
+
+    for (uint16_t i = 0; i < nb_pkts; ++i) {
+        if (!capture_match(pkts[i]))
+            continue;
+        if (--*countdown != 0)
+            continue;
+        *countdown = capture_sample_rate;
+
+        clone = rte_pktmbuf_clone(pkts[i], capture_clone_pool);
+        if (unlikely(clone == NULL)) {
+            stat->cap_dropped++;
+            continue;
+        }
+        *rx_tsc_field(clone) = rx_tsc;
+        clones[nb_clones++] = clone;
+    }
+    if (nb_clones == 0)
+        return;
+
+    nb_enq = rte_ring_enqueue_burst(capture_ring, (void **)clones, nb_clones,
+                                    NULL);
+    stat->captured += nb_enq;
+    if (unlikely(nb_enq < nb_clones)) {
+        stat->cap_dropped += nb_clones - nb_enq;
+        for (unsigned i = nb_enq; i < nb_clones; ++i)
+            rte_pktmbuf_free(clones[i]);
+    }
+}
+
+static void capture_write(struct rte_mbuf *m)
+{
+    static uint8_t buf[CAPTURE_SNAPLEN_MAX];
+    struct pcap_pkt_hdr pkt_hdr;
+    const void *data;
+    const uint64_t tsc_hz = rte_get_tsc_hz();
+    uint64_t diff_tsc = *rx_tsc_field(m) - capture_base_tsc;
+    uint64_t sec = capture_base_ts.tv_sec + diff_tsc / tsc_hz;
+    uint64_t nsec = capture_base_ts.tv_nsec +
+                    (diff_tsc % tsc_hz) * NS_PER_S / tsc_hz;
+
+    pkt_hdr.ts_sec = (uint32_t)(sec + nsec / NS_PER_S);
+    pkt_hdr.ts_nsec = (uint32_t)(nsec % NS_PER_S);
+    pkt_hdr.orig_len = rte_pktmbuf_pkt_len(m);
+    pkt_hdr.incl_len = RTE_MIN(pkt_hdr.orig_len, capture_snaplen);
+
+    data = rte_pktmbuf_read(m, 0, pkt_hdr.incl_len, buf);
+    if (data == NULL)
+        return;
+    fwrite(&pkt_hdr, sizeof(pkt_hdr), 1, capture_fp);
+    fwrite(data, pkt_hdr.incl_len, 1, capture_fp);
+    capture_written++;
+}
+
+/* write out one burst of samples, returns the number of samples dequeued */
+static unsigned capture_drain(void)
+{
+    struct rte_mbuf *pkts[MAX_PKT_BURST];
+    unsigned nb_deq;
+
+    nb_deq = rte_ring_dequeue_burst(capture_ring, (void **)pkts,
+                                    MAX_PKT_BURST, NULL);
+    for (unsigned i = 0; i < nb_deq; ++i) {
+        capture_write(pkts[i]);
+        rte_pktmbuf_free(pkts[i]);
+    }
+    return nb_deq;
+}
+
+static int capture_launch_one_lcore(__attribute__((unused)) void *dummy)
+{
+    rte_log(RTE_LOG_INFO, RTE_LOGTYPE_DPU_FWD,
+            "entering capture loop on lcore %u\n", rte_lcore_id());
+    while (!force_quit)
+        capture_drain();
+    return 0;
+}
+
+/* flush the samples left by the forwarding lcores and close the file */
+static void destroy_capture(void)
+{
+    while (capture_drain() > 0)
+        ;
+    fclose(capture_fp);
+    rte_ring_free(capture_ring);
+    rte_mempool_free(capture_clone_pool);
+}
+
+static void token_bucket_init(struct token_bucket *tb, uint64_t rate_mbps)
+{
+    const double bytes_per_s = rate_mbps * 1e6 / 8;
+
+    tb->bytes_per_tsc = bytes_per_s / rte_get_tsc_hz();
+    tb->size = bytes_per_s * SHAPER_BURST_US / US_PER_S;
+    tb->tokens = tb->size;
+    tb->last_tsc = rte_rdtsc();
+}
+
+static inline void token_bucket_refill(struct token_bucket *tb, uint64_t now)
+{
+    if (tb->bytes_per_tsc == 0)
+        return;
+    tb->tokens = RTE_MIN(tb->size,
+                         tb->tokens + (now - tb->last_tsc) * tb->bytes_per_tsc);
+    tb->last_tsc = now;
+}
+
+/* a full bucket admits any frame, so frames larger than the bucket still pass */
+static inline bool token_bucket_admit(const struct token_bucket *tb, uint32_t len)
+{
+    return tb->bytes_per_tsc == 0 || tb->tokens >= RTE_MIN((double)len, tb->size);
+}
+
+static inline void token_bucket_consume(struct token_bucket *tb, uint32_t len)
+{
+    if (tb->bytes_per_tsc != 0)
+        tb->tokens -= len;
+}
+
+/* bytes of link time a frame takes, as charged to the token buckets */
+static inline uint32_t shaper_wire_len(const struct rte_mbuf *m)
+{
+    return rte_pktmbuf_pkt_len(m) + shaper_frame_overhead;
+}
+
+static void init_shaper(struct shaper *sh, int socket_id)
+{
+    token_bucket_init(&sh->port_tb, shaper_port_rate_mbps);
+    token_bucket_init(&sh->class_tb[SHAPER_CLASS_PRIO], 0);
+    token_bucket_init(&sh->class_tb[SHAPER_CLASS_BULK], shaper_bulk_rate_mbps);
+
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls) {
+        struct shaper_queue *q = &sh->queue[cls];
+
+        q->pkts = rte_zmalloc_socket("shaper_queue",
+                                     shaper_queue_depth * sizeof(struct rte_mbuf *),
+                                     RTE_CACHE_LINE_SIZE, socket_id);
+        if (q->pkts == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot allocate shaper queue\n");
+        q->head = 0;
+        q->tail = 0;
+        q->mask = shaper_queue_depth - 1;
+    }
+}
+
+static void destroy_shaper(struct shaper *sh)
+{
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls) {
+        struct shaper_queue *q = &sh->queue[cls];
+
+        for (; q->head != q->tail; q->head++)
+            rte_pktmbuf_free(q->pkts[q->head & q->mask]);
+        rte_free(q->pkts);
+    }
+}
+
+/* classify a received burst into the shaper lanes, drops on full lanes */
+static inline void shaper_enqueue(struct shaper *sh, struct rte_mbuf **pkts,
+                                  uint16_t nb_pkts, struct dpu_fwd_stat *stat)
+{
+    const uint64_t now = rte_rdtsc();
+
+    for (uint16_t i = 0; i < nb_pkts; ++i) {
+        const int cls = rte_pktmbuf_pkt_len(pkts[i]) <= shaper_prio_size ?
+                        SHAPER_CLASS_PRIO : SHAPER_CLASS_BULK;
+        struct shaper_queue *q = &sh->queue[cls];
+
+        if (unlikely(q->tail - q->head > q->mask)) {
+            stat->cls_dropped[cls]++;
+            rte_pktmbuf_free(pkts[i]);
+            continue;
+        }
+        *rx_tsc_field(pkts[i]) = now;
+        q->pkts[q->tail++ & q->mask] = pkts[i];
+        stat->cls_enq[cls]++;
+    }
+}
+
+/*
+ * Send what the token buckets allow, priority lane first. Packets the TX
+ * ring does not take stay at the head of their lane, uncharged.
+ */
+static inline void shaper_transmit(struct shaper *sh, uint16_t portid,
+                                   struct dpu_fwd_stat *stat)
+{
+    struct rte_mbuf *tx_pkts[MAX_PKT_BURST];
+    uint64_t delay_tsc[MAX_PKT_BURST];
+    uint32_t tx_len[MAX_PKT_BURST];
+    uint8_t tx_cls[MAX_PKT_BURST];
+    uint32_t nb_picked[SHAPER_NB_CLASSES] = { 0 };
+    struct token_bucket port_tb;
+    struct token_bucket class_tb[SHAPER_NB_CLASSES];
+    uint16_t nb_pkts = 0;
+    uint16_t nb_tx;
+    const uint64_t now = rte_rdtsc();
+
+    token_bucket_refill(&sh->port_tb, now);
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls)
+        token_bucket_refill(&sh->class_tb[cls], now);
+
+    /* pick against copies of the buckets, the real ones are charged once sent */
+    port_tb = sh->port_tb;
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls)
+        class_tb[cls] = sh->class_tb[cls];
+
+    while (nb_pkts < MAX_PKT_BURST) {
+        struct rte_mbuf *m = NULL;
+        int cls;
+
+        for (cls = 0; cls < SHAPER_NB_CLASSES; ++cls) {
+            struct shaper_queue *q = &sh->queue[cls];
+            uint32_t next = q->head + nb_picked[cls];
+
+            if (next == q->tail)
+                continue;
+            m = q->pkts[next & q->mask];
+            if (token_bucket_admit(&class_tb[cls], shaper_wire_len(m)))
+                break;
+            /* class over its rate, a lower class may still go */
+            m = NULL;
+        }
+        if (m == NULL ||
+            !token_bucket_admit(&port_tb, shaper_wire_len(m)))
+            break;
+
+        token_bucket_consume(&port_tb, shaper_wire_len(m));
+        token_bucket_consume(&class_tb[cls], shaper_wire_len(m));
+        nb_picked[cls]++;
+        /* the driver may free sent packets right away, read them now */
+        delay_tsc[nb_pkts] = now - *rx_tsc_field(m);
+        tx_len[nb_pkts] = shaper_wire_len(m);
+        tx_cls[nb_pkts] = cls;
+        tx_pkts[nb_pkts++] = m;
+    }
+    if (nb_pkts == 0)
+        return;
+
+    nb_tx = rte_eth_tx_burst(portid, 0, tx_pkts, nb_pkts);
+    stat->sent += nb_tx;
+
+    /* lanes are FIFO, so the sent packets are at the head of their lanes */
+    for (uint16_t i = 0; i < nb_tx; ++i) {
+        const int cls = tx_cls[i];
+
+        sh->queue[cls].head++;
+        token_bucket_consume(&sh->port_tb, tx_len[i]);
+        token_bucket_consume(&sh->class_tb[cls], tx_len[i]);
+        stat->cls_sent[cls]++;
+        stat->cls_delay_tsc[cls] += delay_tsc[i];
+        if (delay_tsc[i] > stat->cls_delay_max_tsc[cls])
+            stat->cls_delay_max_tsc[cls] = delay_tsc[i];
+    }
+}
+
 void init_port(int portid) {
     int ret;
     struct rte_eth_rxconf rxq_conf;
@@ -94,7 +721,9 @@ void init_port(int portid) {
     rte_log(RTE_LOG_DEBUG, RTE_LOGTYPE_DPU_FWD, "Initializing port %u...\n", portid);
     fflush(stdout);
     rte_eth_dev_info_get(portid, &dev_info);
-    if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
+    /* fast free assumes refcnt 1, which does not hold for captured packets */
+    if (capture_file == NULL &&
+        (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE))
         local_port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
 
     ret = rte_eth_dev_configure(portid, 1, 1, &local_port_conf);
@@ -165,6 +794,8 @@ static void dpu_fwd_main_loop(int portid)
     unsigned lcore_id;
     struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
     struct dpu_fwd_stat stat_local;
+    struct shaper shaper;
+    uint32_t capture_countdown = capture_sample_rate;
     initlize_statistics(&stat_local);
 
     lcore_id = rte_lcore_id();
@@ -180,6 +811,9 @@ static void dpu_fwd_main_loop(int portid)
                                                "%d on lcore %u\n",
                                                portid, lcore_id);
 
+    if (shaper_enabled)
+        init_shaper(&shaper, rte_eth_dev_socket_id(portid ^ 1));
+
     /* wait for message */
     while (!force_quit)
     {
@@ -188,23 +822,45 @@ static void dpu_fwd_main_loop(int portid)
         if (nb_rx) {
             stat_local.recv += nb_rx;
 
-            /* Send burst of TX packets, to second port of pair. */
-            const uint16_t nb_tx = rte_eth_tx_burst(portid ^ 1, 0, pkts_burst,
-                                                    nb_rx);
-            stat_local.sent += nb_tx;
-
-            /* Free any unsent packets. */
-            if (unlikely(nb_tx < nb_rx)) {
-                uint16_t buf;
-                for (buf = nb_tx; buf < nb_rx; buf++)
-                    rte_pktmbuf_free(pkts_burst[buf]);
+            if (unlikely(capture_ring != NULL))
+                capture_burst(pkts_burst, nb_rx, &capture_countdown,
+                              &stat_local);
+
+            if (shaper_enabled) {
+                shaper_enqueue(&shaper, pkts_burst, nb_rx, &stat_local);
+            } else {
+                /* Send burst of TX packets, to second port of pair. */
+                const uint16_t nb_tx = rte_eth_tx_burst(portid ^ 1, 0, pkts_burst,
+                                                        nb_rx);
+                stat_local.sent += nb_tx;
+
+                /* Free any unsent packets. */
+                if (unlikely(nb_tx < nb_rx)) {
+                    uint16_t buf;
+                    for (buf = nb_tx; buf < nb_rx; buf++)
+                        rte_pktmbuf_free(pkts_burst[buf]);
+                }
             }
         }
+        if (shaper_enabled)
+            shaper_transmit(&shaper, portid ^ 1, &stat_local);
     }
+    if (shaper_enabled)
+        destroy_shaper(&shaper);
     /* print port statistics when ping main loop finishes */
     pthread_spin_lock(&stat_spinlock);
     stat_global.recv += stat_local.recv;
     stat_global.sent += stat_local.sent;
+    stat_global.captured += stat_local.captured;
+    stat_global.cap_dropped += stat_local.cap_dropped;
+    for (int cls = 0; cls < SHAPER_NB_CLASSES; ++cls) {
+        stat_global.cls_enq[cls] += stat_local.cls_enq[cls];
+        stat_global.cls_sent[cls] += stat_local.cls_sent[cls];
+        stat_global.cls_dropped[cls] += stat_local.cls_dropped[cls];
+        stat_global.cls_delay_tsc[cls] += stat_local.cls_delay_tsc[cls];
+        stat_global.cls_delay_max_tsc[cls] = RTE_MAX(stat_global.cls_delay_max_tsc[cls],
+                                                     stat_local.cls_delay_max_tsc[cls]);
+    }
     pthread_spin_unlock(&stat_spinlock);
     destroy_statistics(&stat_local);
 }
@@ -245,6 +901,11 @@ int main(int argc, char **argv)
     if (ret < 0)
         rte_exit(EXIT_FAILURE, "Set log level to %u failed\n", DPU_FWD_LOG_LEVEL);
 
+    /* parse application arguments (after the EAL ones) */
+    ret = dpu_fwd_parse_args(argc, argv);
+    if (ret < 0)
+        rte_exit(EXIT_FAILURE, "Invalid dpu_fwd arguments\n");
+
     /* get system information */
     nb_sockets = rte_socket_count();
     nb_lcores = rte_lcore_count();
@@ -255,18 +916,39 @@ int main(int argc, char **argv)
     rte_log(RTE_LOG_DEBUG, RTE_LOGTYPE_DPU_FWD, "%d socket(s) %d lcore(s) "
                                                 "%u port(s) detected\n",
                                                 nb_sockets, nb_lcores, nb_ports);
+    if (capture_file != NULL && nb_lcores <= nb_ports)
+        rte_exit(EXIT_FAILURE, "Capture needs a spare lcore: %d lcore(s) "
+                               "for %u port(s)\n", nb_lcores, nb_ports);
 
     force_quit = false;
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
     nb_mbufs = RTE_MAX((unsigned int)(nb_ports * (nb_rxd + nb_txd + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE)), 8192U);
+    /* in-flight samples keep their packet buffers out of the pool */
+    if (capture_file != NULL)
+        nb_mbufs += capture_ring_size;
+    /* as do the packets waiting in the shaper lanes */
+    if (shaper_enabled)
+        nb_mbufs += nb_ports * SHAPER_NB_CLASSES * shaper_queue_depth;
     dpu_fwd_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", nb_mbufs,
                                                     MEMPOOL_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
                                                     rte_socket_id());
     if (dpu_fwd_pktmbuf_pool == NULL)
         rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
 
+    if (capture_file != NULL || shaper_enabled)
+        init_rx_tsc_dynfield();
+    if (capture_file != NULL)
+        init_capture();
+    if (shaper_enabled)
+        rte_log(RTE_LOG_INFO, RTE_LOGTYPE_DPU_FWD,
+                "shaper: port rate %" PRIu64 " Mbps, bulk rate %" PRIu64
+                " Mbps (0 = unlimited), priority frames <= %u bytes, "
+                "%u packets per lane, %u bytes of overhead per frame\n",
+                shaper_port_rate_mbps, shaper_bulk_rate_mbps,
+                shaper_prio_size, shaper_queue_depth, shaper_frame_overhead);
+
     /* init port */
     int portid;
     int portids[RTE_MAX_ETHPORTS]; // port id may be non-contiguous
@@ -278,13 +960,17 @@ int main(int argc, char **argv)
 
     struct lcore_worker_args worker_args;
     unsigned int lcore_id;
+    bool capture_launched = false;
     idx = 1;
     RTE_LCORE_FOREACH_WORKER(lcore_id) {
-        if (idx < nb_ports)
+        if (idx < nb_ports) {
             worker_args.portid = portids[idx++];
-        else
+            rte_eal_remote_launch(dpu_fwd_launch_one_lcore, &worker_args, lcore_id);
+        } else if (capture_ring != NULL && !capture_launched) {
+            rte_eal_remote_launch(capture_launch_one_lcore, NULL, lcore_id);
+            capture_launched = true;
+        } else
             break;
-        rte_eal_remote_launch(dpu_fwd_launch_one_lcore, &worker_args, lcore_id);
     }
 
     worker_args.portid = portids[0];
@@ -292,6 +978,9 @@ int main(int argc, char **argv)
 
     rte_eal_mp_wait_lcore();
 
+    if (capture_ring != NULL)
+        destroy_capture();
+
     rte_log(RTE_LOG_DEBUG, RTE_LOGTYPE_DPU_FWD, "Bye.\n");
     rte_eal_cleanup();
 